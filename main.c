@@ -35,11 +35,26 @@
 #if HAVE_TERMIOS_H
 #include <termios.h>
 #endif
+#if HAVE_SYS_PRCTL_H
+#include <sys/prctl.h>
+#endif
 
 #include <stdio.h>
+#include <stdarg.h>
+#include <limits.h>
 #include <stdlib.h>
 #include <errno.h>
 #include <string.h>
+#include <ctype.h>
+#include <time.h>
+
+#if ENABLE_USDT
+#include <sys/sdt.h>
+// Static tracepoints under the "sshpass" provider. Each carries the child's pid as its first argument
+#define SSHPASS_PROBE(...) STAP_PROBEV(sshpass, __VA_ARGS__)
+#else
+#define SSHPASS_PROBE(...)
+#endif
 
 enum program_return_codes {
     RETURN_NOERROR,
@@ -68,42 +83,132 @@ void window_resize_handler(int signum);
 void sigchld_handler(int signum);
 void term_handler(int signum);
 int match( const char *reference, const char *buffer, ssize_t bufsize, int state );
+int check_host_key( const char *buffer, ssize_t bufsize );
 void write_pass( int fd );
 
 struct {
-    enum { PWT_STDIN, PWT_FILE, PWT_FD, PWT_PASS } pwtype;
+    enum { PWT_STDIN, PWT_FILE, PWT_FD, PWT_PASS, PWT_CMD } pwtype;
     union {
         const char *filename;
         int fd;
         const char *password;
+        const char *command;
     } pwsrc;
 
     const char *pwprompt;
     const char *totpprompt;
     int verbose;
+    int relay;
+    const char **hostkeys;
+    int numhostkeys;
+    const char *cgroup;
+    const char **cglimits;
+    int numcglimits;
     char *orig_password;
     char *ansibleprompt;
+    char *orig_become;
+    const char *become;
     char *totp;
     int attempt;
 } args;
 
+static struct timespec start_time;
+
+// Fill in the time elapsed since the session started
+static void session_elapsed( struct timespec *now )
+{
+    clock_gettime( CLOCK_MONOTONIC, now );
+    now->tv_sec-=start_time.tv_sec;
+    now->tv_nsec-=start_time.tv_nsec;
+    if( now->tv_nsec<0 ) {
+        now->tv_sec--;
+        now->tv_nsec+=1000000000;
+    }
+}
+
+// With -vv, report a session event along with the time elapsed since the session started
+static void trace_event( const char *format, ... )
+{
+    struct timespec now;
+    va_list ap;
+
+    if( args.verbose<2 )
+        return;
+
+    session_elapsed( &now );
+
+    fprintf(stderr, "SSHPASS: [%ld.%06ld] ", (long)now.tv_sec, now.tv_nsec/1000);
+    va_start( ap, format );
+    vfprintf( stderr, format, ap );
+    va_end( ap );
+    fputc( '\n', stderr );
+}
+
 static void show_help()
 {
-    printf("Usage: " PACKAGE_NAME " [-f|-d|-p|-e] [-hV] command parameters\n"
+    printf("Usage: " PACKAGE_NAME " [-f|-d|-p|-e|-c] [-hV] command parameters\n"
             "   -f filename   Take password to use from file\n"
             "   -d number     Use number as file descriptor for getting password\n"
             "   -a attempt    Number of password attempts\n"
             "   -p password   Provide password as argument (security unwise)\n"
             "   -e            Password is passed as env-var \"SSHPASS\"\n"
+            "   -c command    Run command once, and use the first line it outputs as password\n"
             "   With no parameters - password will be taken from stdin\n\n"
             "   -P prompt     Which string should sshpass search for to detect a password prompt\n"
             "   -t TOTP       Provide TOTP as argument\n"
             "   -T prompt     Which string should sshpass search for to detect a TOTP prompt\n"
             "   -A prompt     Which string should sshpass search for to detect a ansible prompt\n"
-            "   -v            Be verbose about what you're doing\n"
+            "   -b password   Provide the password for the ansible prompt, if it differs from the login one\n"
+            "   -k key|file   Accept an unknown host if its key fingerprint is key, or is listed in file\n"
+            "   -g directory  Run the command in its own cgroup, created under directory, and report its usage\n"
+            "   -G file=value Write value to file in the command's cgroup (e.g. memory.max=1G)\n"
+            "   -r            Relay the command's stdin and stdout, and report how many bytes were moved\n"
+            "   -v            Be verbose about what you're doing (twice for timestamped events)\n"
             "   -h            Show help (this screen)\n"
             "   -V            Print version information\n"
-            "At most one of -f, -d, -p or -e should be used\n");
+            "At most one of -f, -d, -p, -e or -c should be used\n");
+}
+
+// Add a fingerprint, or all fingerprints listed in a file, to the host key allowlist. Return 0 on success
+static int add_hostkeys( const char *arg )
+{
+    if( strncmp( arg, "SHA256:", 7 )==0 || strncmp( arg, "MD5:", 4 )==0 ) {
+        args.hostkeys=realloc( args.hostkeys, sizeof(*args.hostkeys)*(args.numhostkeys+1) );
+        args.hostkeys[args.numhostkeys++]=arg;
+
+        return 0;
+    }
+
+    FILE *file=fopen( arg, "r" );
+    char *line=NULL;
+    size_t linesize=0;
+    ssize_t length;
+
+    if( file==NULL ) {
+        fprintf(stderr, "SSHPASS: Failed to open host key file \"%s\": %s\n", arg, strerror(errno));
+
+        return -1;
+    }
+
+    // One fingerprint per line. Empty lines and lines starting with # are ignored
+    while( (length=getline( &line, &linesize, file ))>=0 ) {
+        char *fingerprint=line;
+
+        while( length>0 && isspace( (unsigned char)line[length-1] ) )
+            line[--length]='\0';
+        while( isspace( (unsigned char)*fingerprint ) )
+            ++fingerprint;
+
+        if( *fingerprint!='\0' && *fingerprint!='#' ) {
+            args.hostkeys=realloc( args.hostkeys, sizeof(*args.hostkeys)*(args.numhostkeys+1) );
+            args.hostkeys[args.numhostkeys++]=strdup( fingerprint );
+        }
+    }
+
+    free( line );
+    fclose( file );
+
+    return 0;
 }
 
 // Parse the command line. Fill in the "args" global struct with the results. Return argv offset
@@ -123,7 +228,7 @@ static int parse_options( int argc, char *argv[] )
     fprintf(stderr, "Conflicting password source\n"); \
     error=RETURN_CONFLICTING_ARGUMENTS; }
 
-    while( (opt=getopt(argc, argv, "+f:d:p:P:t:T:A:a:heVv"))!=-1 && error==-1 ) {
+    while( (opt=getopt(argc, argv, "+f:d:p:c:P:t:T:A:b:a:k:g:G:rheVv"))!=-1 && error==-1 ) {
         switch( opt ) {
         case 'f':
             // Password should come from a file
@@ -149,12 +254,39 @@ static int parse_options( int argc, char *argv[] )
             args.pwtype=PWT_PASS;
             args.orig_password=optarg;
             break;
+        case 'c':
+            // Password is the output of a command
+            VIRGIN_PWTYPE;
+
+            args.pwtype=PWT_CMD;
+            args.pwsrc.command=optarg;
+            break;
         case 'P':
             args.pwprompt=optarg;
             break;
         case 'v':
             args.verbose++;
             break;
+        case 'r':
+            args.relay=1;
+            break;
+        case 'k':
+            if( add_hostkeys( optarg )!=0 )
+                error=RETURN_INVALID_ARGUMENTS;
+            break;
+        case 'g':
+            args.cgroup=optarg;
+            break;
+        case 'G':
+            if( strchr( optarg, '=' )==NULL ) {
+                fprintf(stderr, "SSHPASS: -G expects file=value, got \"%s\"\n", optarg);
+                error=RETURN_INVALID_ARGUMENTS;
+                break;
+            }
+
+            args.cglimits=realloc( args.cglimits, sizeof(*args.cglimits)*(args.numcglimits+1) );
+            args.cglimits[args.numcglimits++]=optarg;
+            break;
         case 'e':
             VIRGIN_PWTYPE;
 
@@ -175,6 +307,9 @@ static int parse_options( int argc, char *argv[] )
         case 'A':
             args.ansibleprompt=optarg;
             break;
+        case 'b':
+            args.orig_become=optarg;
+            break;
         case '?':
         case ':':
             error=RETURN_INVALID_ARGUMENTS;
@@ -195,12 +330,57 @@ static int parse_options( int argc, char *argv[] )
         }
     }
 
+    if( error==-1 && args.numcglimits>0 && args.cgroup==NULL ) {
+        fprintf(stderr, "The -G option requires -g\n");
+        error=RETURN_CONFLICTING_ARGUMENTS;
+    }
+
+    if( error==-1 && args.relay &&
+            (args.pwtype==PWT_STDIN || (args.pwtype==PWT_FD && args.pwsrc.fd==STDIN_FILENO)) )
+    {
+        // The relay would swallow the password along with the rest of stdin
+        fprintf(stderr, "The -r option cannot be used with a password taken from stdin\n");
+        error=RETURN_CONFLICTING_ARGUMENTS;
+    }
+
     if( error>=0 )
         return -(error+1);
     else
         return optind;
 }
 
+// Run the password command, and return the first line of its output. Returns NULL on failure
+static char *run_password_command( const char *command )
+{
+    FILE *output=popen( command, "r" );
+    char *line=NULL, discard[4096];
+    size_t linesize=0;
+    ssize_t length;
+
+    if( output==NULL ) {
+        perror("SSHPASS: Failed to run password command");
+
+        return NULL;
+    }
+
+    length=getline( &line, &linesize, output );
+    if( length>0 && line[length-1]=='\n' )
+        line[length-1]='\0';
+
+    // Consume the rest of the output, so that a chatty command does not die of SIGPIPE
+    while( fread( discard, 1, sizeof(discard), output )>0 )
+        ;
+
+    if( pclose( output )!=0 || length<0 || line[0]=='\0' ) {
+        fprintf(stderr, "SSHPASS: Password command \"%s\" failed\n", command);
+        free( line );
+
+        return NULL;
+    }
+
+    return line;
+}
+
 int main( int argc, char *argv[] )
 {
     int opt_offset=parse_options( argc, argv );
@@ -228,6 +408,22 @@ int main( int argc, char *argv[] )
         }
     }
 
+    if( args.orig_become!=NULL ) {
+        args.become = strdup(args.orig_become);
+
+        while( *args.orig_become != '\0' ) {
+            *args.orig_become = 'x';
+            ++args.orig_become;
+        }
+    }
+
+    if( args.pwtype==PWT_CMD ) {
+        // Only pay for running the command once, however many times we are prompted
+        args.pwsrc.password=run_password_command( args.pwsrc.command );
+        if( args.pwsrc.password==NULL )
+            return RETURN_RUNTIME_ERROR;
+    }
+
     return runprogram( argc-opt_offset, argv+opt_offset );
 }
 
@@ -235,14 +431,308 @@ int main( int argc, char *argv[] )
 static int ourtty; // Our own tty
 static int masterpt;
 
+/* One direction of the -r relay. pipefd is the end of the child's pipe that we own. While blocked is set, dst
+   would not take more data, and we wait for it to become writable rather than for src to become readable */
+struct relay {
+    int src, dst;
+    int pipefd;
+    int blocked;
+    long long bytes;
+    char buffer[PIPE_BUF]; // Data read but not yet written, when splice cannot be used
+    size_t offset, pending;
+};
+
+static struct relay relay_in={ .src=-1, .dst=-1, .pipefd=-1 }, relay_out={ .src=-1, .dst=-1, .pipefd=-1 };
+
 int childpid;
 int term;
 int attempts;
+int become_answers;
+int orphans;
+
+/* How long the child's process group gets to exit after a forwarded SIGTERM/SIGHUP, before we send SIGKILL */
+#define KILL_GRACE_SECONDS 5
+
+static struct timespec kill_deadline; // Set by term_handler once a terminating signal was forwarded
+static int escalated;
+
+// Shut down one direction of the relay. Closing our end of the pipe passes the end of file along
+static void relay_close( struct relay *relay )
+{
+    close( relay->pipefd );
+    relay->src=-1;
+    relay->blocked=0;
+    relay->pending=0;
+}
+
+// Whether there is data to read from fd right now
+static int fd_readable( int fd )
+{
+    fd_set readfd;
+    struct timeval timeout={ 0, 0 };
+
+    FD_ZERO(&readfd);
+    FD_SET(fd, &readfd);
+
+    return select( fd+1, &readfd, NULL, NULL, &timeout )>0;
+}
+
+// Move whatever data is available along the relay, without copying it through user space where possible.
+// Returns the number of bytes moved. Sets blocked if dst would not take all there was to move
+static ssize_t relay_step( struct relay *relay )
+{
+    ssize_t moved;
+
+    relay->blocked=0;
+
+#if HAVE_SPLICE
+    if( relay->pending==0 ) {
+        moved=splice( relay->src, NULL, relay->dst, NULL, 65536, SPLICE_F_MOVE|SPLICE_F_NONBLOCK );
+        if( moved>0 ) {
+            relay->bytes+=moved;
+
+            return moved;
+        }
+
+        if( moved<0 && errno==EAGAIN ) {
+            // Either src is empty, or dst is full
+            relay->blocked=fd_readable( relay->src );
+
+            return 0;
+        }
+
+        if( moved==0 || errno!=EINVAL ) {
+            relay_close( relay );
+
+            return 0;
+        }
+
+        // EINVAL: one of the fds does not support splice. Copy through our buffer instead
+    }
+#endif
+
+    if( relay->pending==0 ) {
+        moved=read( relay->src, relay->buffer, sizeof(relay->buffer) );
+        if( moved<0 && errno==EAGAIN )
+            return 0;
+
+        if( moved<=0 ) {
+            relay_close( relay );
+
+            return 0;
+        }
+
+        relay->offset=0;
+        relay->pending=moved;
+    }
+
+    moved=write( relay->dst, relay->buffer+relay->offset, relay->pending );
+    if( moved<0 ) {
+        if( errno==EAGAIN ) {
+            relay->blocked=1;
+        } else {
+            relay_close( relay );
+        }
+
+        return 0;
+    }
+
+    relay->offset+=moved;
+    relay->pending-=moved;
+    relay->bytes+=moved;
+    relay->blocked=( relay->pending>0 );
+
+    return moved;
+}
+
+// Add the relay's fd we are waiting on to the select sets. Returns it, or -1 if this direction is shut down
+static int relay_fdset( struct relay *relay, fd_set *readfd, fd_set *writefd )
+{
+    if( relay->src==-1 )
+        return -1;
+
+    if( relay->blocked ) {
+        FD_SET( relay->dst, writefd );
+
+        return relay->dst;
+    }
+
+    FD_SET( relay->src, readfd );
+
+    return relay->src;
+}
+
+// Whether select found the fd we are waiting on ready
+static int relay_isset( struct relay *relay, fd_set *readfd, fd_set *writefd )
+{
+    if( relay->src==-1 )
+        return 0;
+
+    return relay->blocked ? FD_ISSET( relay->dst, writefd ) : FD_ISSET( relay->src, readfd );
+}
+
+/* The session's own cgroup (-g), or NULL */
+static char *cgroup_path;
+
+// Write a value to one of the session cgroup's control files. Returns 0 on success
+static int cgroup_write( const char *file, const char *value )
+{
+    char path[PATH_MAX];
+    size_t length=strlen( value );
+    int fd, ret;
+
+    snprintf( path, sizeof(path), "%s/%s", cgroup_path, file );
+    fd=open( path, O_WRONLY );
+    if( fd==-1 )
+        return -1;
+
+    ret=( write( fd, value, length )==(ssize_t)length ) ? 0 : -1;
+    close( fd );
+
+    return ret;
+}
+
+// Read a counter from one of the session cgroup's control files. With a NULL key, the file holds just the counter.
+// Returns -1 if the counter is not available
+static long long cgroup_read( const char *file, const char *key )
+{
+    char path[PATH_MAX], name[64];
+    long long value, ret=-1;
+    FILE *stats;
+
+    snprintf( path, sizeof(path), "%s/%s", cgroup_path, file );
+    stats=fopen( path, "r" );
+    if( stats==NULL )
+        return -1;
+
+    if( key==NULL ) {
+        if( fscanf( stats, "%lld", &value )==1 )
+            ret=value;
+    } else {
+        while( fscanf( stats, "%63s %lld", name, &value )==2 ) {
+            if( strcmp( name, key )==0 ) {
+                ret=value;
+                break;
+            }
+        }
+    }
+
+    fclose( stats );
+
+    return ret;
+}
+
+// Create the session cgroup and apply the -G settings to it. Returns 0 on success
+static int cgroup_create()
+{
+    char path[PATH_MAX];
+    int i;
+
+    snprintf( path, sizeof(path), "%s/sshpass.%d", args.cgroup, (int)getpid() );
+    if( mkdir( path, 0755 )!=0 ) {
+        fprintf(stderr, "SSHPASS: Failed to create cgroup \"%s\": %s\n", path, strerror(errno));
+
+        return -1;
+    }
+
+    cgroup_path=strdup( path );
+
+    for( i=0; i<args.numcglimits; ++i ) {
+        char *file=strdup( args.cglimits[i] );
+        char *value=strchr( file, '=' );
+
+        *value++='\0';
+        if( cgroup_write( file, value )!=0 ) {
+            fprintf(stderr, "SSHPASS: Failed to set cgroup %s to \"%s\": %s\n", file, value, strerror(errno));
+            free( file );
+            rmdir( cgroup_path );
+
+            return -1;
+        }
+
+        free( file );
+    }
+
+    return 0;
+}
+
+// Report the session cgroup's resource usage, and remove it if nothing is left running in it
+static void cgroup_finish()
+{
+    long long usage=cgroup_read( "cpu.stat", "usage_usec" );
+    long long peak=cgroup_read( "memory.peak", NULL );
+
+    // Either counter may be missing, e.g. if the delegated subtree does not enable the memory controller
+    if( usage>=0 || peak>=0 ) {
+        fprintf(stderr, "SSHPASS: cgroup used");
+        if( usage>=0 ) {
+            fprintf(stderr, " %lld usec CPU (%lld user, %lld system)",
+                    usage, cgroup_read( "cpu.stat", "user_usec" ), cgroup_read( "cpu.stat", "system_usec" ));
+        }
+        if( peak>=0 )
+            fprintf(stderr, "%s peak memory %lld bytes", usage>=0 ? "," : "", peak);
+        fputc( '\n', stderr );
+    }
+
+    if( rmdir( cgroup_path )!=0 && args.verbose )
+        fprintf(stderr, "SSHPASS: leaving cgroup \"%s\" in place: %s\n", cgroup_path, strerror(errno));
+}
+
+// Once the grace period after a forwarded terminating signal runs out, SIGKILL the child's process group.
+// Otherwise, fill in the time left and return it. Returns NULL if no escalation is pending
+static struct timespec *escalation_timeout( struct timespec *timeout )
+{
+    struct timespec now;
+
+    if( kill_deadline.tv_sec==0 || escalated )
+        return NULL;
+
+    clock_gettime( CLOCK_MONOTONIC, &now );
+    timeout->tv_sec=kill_deadline.tv_sec-now.tv_sec;
+    timeout->tv_nsec=kill_deadline.tv_nsec-now.tv_nsec;
+    if( timeout->tv_nsec<0 ) {
+        timeout->tv_sec--;
+        timeout->tv_nsec+=1000000000;
+    }
+
+    if( timeout->tv_sec<0 ) {
+        if( args.verbose )
+            fprintf(stderr, "SSHPASS: process group still running %d seconds after being signalled. Sending SIGKILL.\n",
+                    KILL_GRACE_SECONDS);
+        if( kill( -childpid, SIGKILL )!=0 )
+            kill( childpid, SIGKILL );
+        escalated=1;
+
+        return NULL;
+    }
+
+    return timeout;
+}
+
+// Wait for the child to change state. Descendants that were orphaned and re-parented to us are reaped along the way
+static pid_t wait_child( int *status, int options )
+{
+    pid_t pid;
+    int childstatus;
+
+    while( (pid=waitpid( -1, &childstatus, options ))>0 ) {
+        if( pid==childpid ) {
+            *status=childstatus;
+            break;
+        }
+
+        ++orphans;
+    }
+
+    return pid;
+}
 
 int runprogram( int argc, char *argv[] )
 {
     struct winsize ttysize; // The size of our tty
 
+    clock_gettime( CLOCK_MONOTONIC, &start_time );
+
     // We need to interrupt a select with a SIGCHLD. In order to do so, we need a SIGCHLD handler
     signal( SIGCHLD, sigchld_handler );
 
@@ -324,6 +814,28 @@ int runprogram( int argc, char *argv[] )
     signal(SIGINT, term_handler);
     signal(SIGTSTP, term_handler);
 
+#if defined(PR_SET_CHILD_SUBREAPER)
+    // ProxyCommand helpers and the like may outlive ssh. Have them re-parented to us rather than to init, so
+    // that we can reap them
+    prctl( PR_SET_CHILD_SUBREAPER, 1 );
+#endif
+
+    int inpipe[2], outpipe[2];
+
+    if( args.relay ) {
+        if( pipe( inpipe )!=0 || pipe( outpipe )!=0 ) {
+            perror("SSHPASS: Failed to create relay pipes");
+
+            return RETURN_RUNTIME_ERROR;
+        }
+
+        // A closed reader shuts down that direction of the relay, rather than killing us
+        signal(SIGPIPE, SIG_IGN);
+    }
+
+    if( args.cgroup!=NULL && cgroup_create()!=0 )
+        return RETURN_RUNTIME_ERROR;
+
     childpid=fork();
     if( childpid==0 ) {
         // Child
@@ -331,6 +843,22 @@ int runprogram( int argc, char *argv[] )
         // Re-enable all signals to child
         sigprocmask( SIG_SETMASK, &sigmask_select, NULL );
 
+        // Move ourselves into the session cgroup before running the command, so that all it does is accounted there
+        if( cgroup_path!=NULL && cgroup_write( "cgroup.procs", "0" )!=0 ) {
+            perror("SSHPASS: Failed to join session cgroup");
+            exit(RETURN_RUNTIME_ERROR);
+        }
+
+        if( args.relay ) {
+            signal(SIGPIPE, SIG_DFL);
+            dup2( inpipe[0], STDIN_FILENO );
+            dup2( outpipe[1], STDOUT_FILENO );
+            close( inpipe[0] );
+            close( inpipe[1] );
+            close( outpipe[0] );
+            close( outpipe[1] );
+        }
+
         // Detach us from the current TTY
         setsid();
         // This line makes the ptty our controlling tty. We do not otherwise need it open
@@ -366,10 +894,28 @@ int runprogram( int argc, char *argv[] )
     } else if( childpid<0 ) {
         perror("SSHPASS: Failed to create child process");
 
+        if( cgroup_path!=NULL )
+            rmdir( cgroup_path );
+
         return RETURN_RUNTIME_ERROR;
     }
 
     // We are the parent
+    if( args.relay ) {
+        close( inpipe[0] );
+        close( outpipe[1] );
+
+        // Without splice, we write to the child's stdin through a buffer, and must not block on a full pipe
+        fcntl( inpipe[1], F_SETFL, O_NONBLOCK );
+
+        relay_in.src=STDIN_FILENO;
+        relay_in.dst=relay_in.pipefd=inpipe[1];
+        relay_out.src=relay_out.pipefd=outpipe[0];
+        relay_out.dst=STDOUT_FILENO;
+    }
+
+    trace_event("spawned child %d", childpid);
+    SSHPASS_PROBE(spawn, childpid);
     slavept=open(name, O_RDWR|O_NOCTTY );
 
     int status=0;
@@ -378,14 +924,27 @@ int runprogram( int argc, char *argv[] )
 
     do {
         if( !terminate ) {
-            fd_set readfd;
+            fd_set readfd, writefd;
+            int maxfd=masterpt, relayfd;
 
             FD_ZERO(&readfd);
+            FD_ZERO(&writefd);
             FD_SET(masterpt, &readfd);
 
-            int selret=pselect( masterpt+1, &readfd, NULL, NULL, NULL, &sigmask_select );
+            if( (relayfd=relay_fdset( &relay_in, &readfd, &writefd ))>maxfd )
+                maxfd=relayfd;
+            if( (relayfd=relay_fdset( &relay_out, &readfd, &writefd ))>maxfd )
+                maxfd=relayfd;
+
+            struct timespec timeout;
+            int selret=pselect( maxfd+1, &readfd, &writefd, NULL, escalation_timeout( &timeout ), &sigmask_select );
 
             if( selret>0 ) {
+                if( relay_isset( &relay_in, &readfd, &writefd ) )
+                    relay_step( &relay_in );
+                if( relay_isset( &relay_out, &readfd, &writefd ) )
+                    relay_step( &relay_out );
+
                 if( FD_ISSET( masterpt, &readfd ) ) {
                     int ret;
                     if( (ret=handleoutput( masterpt )) ) {
@@ -406,12 +965,76 @@ int runprogram( int argc, char *argv[] )
                     }
                 }
             }
-            wait_id=waitpid( childpid, &status, WNOHANG );
+            wait_id=wait_child( &status, WNOHANG );
         } else {
-            wait_id=waitpid( childpid, &status, 0 );
+            wait_id=wait_child( &status, 0 );
         }
     } while( wait_id==0 || (!WIFEXITED( status ) && !WIFSIGNALED( status )) );
 
+    SSHPASS_PROBE(exit, childpid, status);
+    if( WIFEXITED( status ) )
+        trace_event("child exited with status %d", WEXITSTATUS( status ));
+    else
+        trace_event("child terminated by signal %d", WTERMSIG( status ));
+
+    if( args.relay ) {
+        struct timespec elapsed;
+        double seconds;
+
+        // Pass along what the child wrote before exiting. Don't wait for descendants that still hold the pipe
+        if( relay_out.src!=-1 ) {
+            fcntl( relay_out.src, F_SETFL, O_NONBLOCK );
+            while( relay_out.src!=-1 ) {
+                if( relay_step( &relay_out )>0 )
+                    continue;
+                if( !relay_out.blocked )
+                    break;
+
+                // Our stdout is backed up. Wait for it, rather than drop what the child wrote
+                fd_set writefd;
+
+                FD_ZERO(&writefd);
+                FD_SET(relay_out.dst, &writefd);
+                select( relay_out.dst+1, NULL, &writefd, NULL, NULL );
+            }
+            if( relay_out.src!=-1 )
+                close( relay_out.pipefd );
+        }
+        if( relay_in.src!=-1 )
+            close( relay_in.pipefd );
+
+        session_elapsed( &elapsed );
+        seconds=elapsed.tv_sec+elapsed.tv_nsec/1e9;
+        fprintf(stderr, "SSHPASS: relayed %lld bytes in (%.0f bytes/s), %lld bytes out (%.0f bytes/s) over %.3f seconds\n",
+                relay_in.bytes, seconds>0 ? relay_in.bytes/seconds : 0.0,
+                relay_out.bytes, seconds>0 ? relay_out.bytes/seconds : 0.0, seconds);
+    }
+
+    // Helpers that survive a forwarded terminating signal get the rest of the grace period, then SIGKILL
+    while( kill_deadline.tv_sec!=0 && !escalated && kill( -childpid, 0 )==0 ) {
+        struct timespec timeout, pause={ 0, 50000000 };
+
+        if( escalation_timeout( &timeout )==NULL )
+            break;
+
+        nanosleep( &pause, NULL );
+        while( waitpid( -1, NULL, WNOHANG )>0 )
+            ++orphans;
+    }
+
+    // Collect whatever descendants have already exited. Those still running (e.g. "ssh -f") are left alone
+    while( waitpid( -1, NULL, WNOHANG )>0 )
+        ++orphans;
+
+    if( args.verbose && become_answers>0 )
+        fprintf(stderr, "SSHPASS: answered %d ansible prompts\n", become_answers);
+
+    if( args.verbose && orphans>0 )
+        fprintf(stderr, "SSHPASS: reaped %d orphaned descendant processes\n", orphans);
+
+    if( cgroup_path!=NULL )
+        cgroup_finish();
+
     if( terminate>0 )
         return terminate;
     else if( WIFEXITED( status ) )
@@ -425,6 +1048,7 @@ int handleoutput( int fd )
     // We are looking for the string
     static int state0, state1, state2, state3, state4;
     static int firsttime = 1;
+    static int hostkey_pending;
     static const char *compare0=ANSIBLE_PROMPT; // Asking for a password
     static const char *compare1=PASSWORD_PROMPT; // Asking for a password
     static const char compare2[]="The authenticity of host "; // Asks to authenticate host
@@ -433,7 +1057,7 @@ int handleoutput( int fd )
     // static const char compare3[]="WARNING: REMOTE HOST IDENTIFICATION HAS CHANGED!"; // Warns about man in the middle attack
     // The remote identification changed error is sent to stderr, not the tty, so we do not handle it.
     // This is not a problem, as ssh exists immediately in such a case
-    char buffer[256];
+    char buffer[4096];
     int ret=0;
 
     if( args.ansibleprompt ) {
@@ -453,71 +1077,187 @@ int handleoutput( int fd )
         fprintf(stderr, "SSHPASS: searching for password prompt using match \"%s\"\n", compare1);
     }
 
-    int numread=read(fd, buffer, sizeof(buffer)-1 );
-    buffer[numread] = '\0';
-    if( args.verbose ) {
-        fprintf(stderr, "SSHPASS: read: %s\n", buffer);
-    }
+    int numread;
 
-    state0 = match(compare0, buffer, numread, state0);
+    // Drain everything the pty has for us, rather than taking a single bite per select
+    do {
+        numread=read(fd, buffer, sizeof(buffer)-1 );
+        if( numread<=0 )
+            break;
 
-    if (compare0[state0] == '\0') {
-        if (args.verbose)
-            fprintf(stderr, "SSHPASS: detected ansible prompt. Sending password.\n");
-        write_pass( fd );
-        state0=0;
-    }
+        buffer[numread] = '\0';
+        SSHPASS_PROBE(read, childpid, numread);
+        if( args.verbose ) {
+            fprintf(stderr, "SSHPASS: read: %s\n", buffer);
+        }
 
-    state1=match( compare1, buffer, numread, state1 );
+        int become_prompt=0;
 
-    // Are we at a password prompt?
-    if( compare1[state1]=='\0' ) {
-        if( args.attempt > 0 ) {
-            ++attempts;
+        state0 = match(compare0, buffer, numread, state0);
 
-            if( args.verbose )
-                fprintf(stderr, "SSHPASS: detected prompt. Sending password. Attempt #%d\n", attempts);
-            write_pass( fd );
+        if (compare0[state0] == '\0') {
+            become_prompt=1;
+            ++become_answers;
+            trace_event("ansible prompt matched");
+            SSHPASS_PROBE(prompt, childpid, (const char *)"ansible");
+            if (args.verbose)
+                fprintf(stderr, "SSHPASS: detected ansible prompt. Sending password.\n");
+            SSHPASS_PROBE(password_write, childpid, (const char *)"ansible");
+            if( args.become ) {
+                reliable_write( fd, args.become, strlen( args.become ) );
+                reliable_write( fd, "\n", 1 );
+            } else {
+                write_pass( fd );
+            }
+            state0=0;
             state1=0;
-            --args.attempt;
-        } else {
-            // Wrong password - terminate with proper error code
-            if( args.verbose )
-                fprintf(stderr, "SSHPASS: password entry attempts used up. Wrong password. Terminating.\n");
-            ret=RETURN_INCORRECT_PASSWORD;
         }
-    }
 
-    if( ret==0 ) {
-        state2=match( compare2, buffer, numread, state2 );
+        // The ansible prompt may contain the password prompt (e.g. "BECOME password:"). Don't answer it twice
+        if( !become_prompt )
+            state1=match( compare1, buffer, numread, state1 );
+
+        // Are we at a password prompt?
+        if( compare1[state1]=='\0' ) {
+            if( args.attempt > 0 ) {
+                ++attempts;
+                trace_event("password prompt matched, attempt %d", attempts);
+                SSHPASS_PROBE(prompt, childpid, (const char *)"password");
+
+                if( args.verbose )
+                    fprintf(stderr, "SSHPASS: detected prompt. Sending password. Attempt #%d\n", attempts);
+                SSHPASS_PROBE(password_write, childpid, (const char *)"password");
+                write_pass( fd );
+                state1=0;
+                --args.attempt;
+            } else {
+                // Wrong password - terminate with proper error code
+                if( args.verbose )
+                    fprintf(stderr, "SSHPASS: password entry attempts used up. Wrong password. Terminating.\n");
+                ret=RETURN_INCORRECT_PASSWORD;
+            }
+        }
+
+        if( ret==0 ) {
+            state2=match( compare2, buffer, numread, state2 );
+
+            // Are we being prompted to authenticate the host?
+            if( compare2[state2]=='\0' ) {
+                trace_event("host authentication prompt matched");
+                SSHPASS_PROBE(prompt, childpid, (const char *)"hostkey");
+                if( args.numhostkeys==0 ) {
+                    if( args.verbose )
+                        fprintf(stderr, "SSHPASS: detected host authentication prompt. Exiting.\n");
+                    ret=RETURN_HOST_KEY_UNKNOWN;
+                } else {
+                    if( args.verbose )
+                        fprintf(stderr, "SSHPASS: detected host authentication prompt. Checking fingerprint.\n");
+                    hostkey_pending=1;
+                    state2=0;
+                }
+            } else {
+                state3 = match( compare3, buffer, numread, state3 );
+                // Host key changed
+                if ( compare3[state3]=='\0' ) {
+                    ret=RETURN_HOST_KEY_CHANGED;
+                }
+            }
+        }
+
+        if( ret==0 && args.numhostkeys>0 ) {
+            int verdict=check_host_key( buffer, numread );
 
-        // Are we being prompted to authenticate the host?
-        if( compare2[state2]=='\0' ) {
-            if( args.verbose )
-                fprintf(stderr, "SSHPASS: detected host authentication prompt. Exiting.\n");
-            ret=RETURN_HOST_KEY_UNKNOWN;
-        } else {
-            state3 = match( compare3, buffer, numread, state3 );
-            // Host key changed
-            if ( compare3[state3]=='\0' ) {
-                ret=RETURN_HOST_KEY_CHANGED;
+            if( verdict<0 && hostkey_pending ) {
+                ret=RETURN_HOST_KEY_UNKNOWN;
+            } else if( verdict>0 && hostkey_pending ) {
+                reliable_write( fd, "yes\n", 4 );
+                hostkey_pending=0;
             }
         }
-    }
 
-    if ( ret==0 && atoi(args.totp) > 0 ) {
-        state4 = match(compare4, buffer, numread, state4);
+        if ( ret==0 && atoi(args.totp) > 0 ) {
+            state4 = match(compare4, buffer, numread, state4);
+
+            if (compare4[state4] == '\0') {
+                trace_event("TOTP prompt matched");
+                SSHPASS_PROBE(prompt, childpid, (const char *)"totp");
+                if (args.verbose)
+                    fprintf(stderr, "SSHPASS: detected TOTP prompt, sending code\n");
+                SSHPASS_PROBE(password_write, childpid, (const char *)"totp");
+                reliable_write(fd, args.totp, strlen(args.totp));
+                reliable_write(fd, "\n", 1);
+                state4=0;
+            }
+        }
+    } while( ret==0 && numread==sizeof(buffer)-1 );
 
-        if (compare4[state4] == '\0') {
-            if (args.verbose)
-                fprintf(stderr, "SSHPASS: detected TOTP prompt, sending code\n");
-            reliable_write(fd, args.totp, strlen(args.totp));
-            reliable_write(fd, "\n", 1);
-            state4=0;
+    return ret;
+}
+
+// Follow ssh's host authentication prompt. Returns 1 once ssh asks whether to continue and the fingerprint it
+// showed is on the allowlist, -1 if the fingerprint is not on the allowlist, and 0 if more output is needed
+int check_host_key( const char *buffer, ssize_t bufsize )
+{
+    static const char marker[]="key fingerprint is ";
+    static const char question[]="(yes/no";
+    static enum { HK_MARKER, HK_FINGERPRINT, HK_QUESTION } stage;
+    static int state;
+    static char fingerprint[128];
+    static size_t fplength;
+    ssize_t i;
+    int j;
+
+    for( i=0; i<bufsize; ++i ) {
+        switch( stage ) {
+        case HK_MARKER:
+            state=match( marker, buffer+i, 1, state );
+            if( marker[state]=='\0' ) {
+                stage=HK_FINGERPRINT;
+                fplength=0;
+            }
+            break;
+        case HK_FINGERPRINT:
+            // Base64 for SHA256, hex and colons for MD5. Anything else ends the fingerprint
+            if( (isalnum( (unsigned char)buffer[i] ) || (buffer[i]!='\0' && strchr( "+/:", buffer[i] )!=NULL)) &&
+                    fplength<sizeof(fingerprint)-1 )
+            {
+                fingerprint[fplength++]=buffer[i];
+                break;
+            }
+
+            fingerprint[fplength]='\0';
+            state=0;
+            stage=HK_MARKER;
+
+            for( j=0; j<args.numhostkeys; ++j ) {
+                if( strcmp( fingerprint, args.hostkeys[j] )==0 ) {
+                    if( args.verbose )
+                        fprintf(stderr, "SSHPASS: host key fingerprint %s is on the allowlist\n", fingerprint);
+                    stage=HK_QUESTION;
+                    break;
+                }
+            }
+
+            if( stage!=HK_QUESTION ) {
+                if( args.verbose )
+                    fprintf(stderr, "SSHPASS: host key fingerprint %s is not on the allowlist\n", fingerprint);
+
+                return -1;
+            }
+            break;
+        case HK_QUESTION:
+            state=match( question, buffer+i, 1, state );
+            if( question[state]=='\0' ) {
+                state=0;
+                stage=HK_MARKER;
+
+                return 1;
+            }
+            break;
         }
     }
 
-    return ret;
+    return 0;
 }
 
 int match( const char *reference, const char *buffer, ssize_t bufsize, int state )
@@ -559,6 +1299,7 @@ void write_pass( int fd )
             }
         }
         break;
+    case PWT_CMD: // main() replaced the command with its output
     case PWT_PASS:
         reliable_write( fd, args.pwsrc.password, strlen( args.pwsrc.password ) );
         reliable_write( fd, "\n", 1 );
@@ -602,6 +1343,7 @@ void sigchld_handler(int signum)
 
 void term_handler(int signum)
 {
+    SSHPASS_PROBE(signal, childpid, signum);
     fflush(stdout);
     switch(signum) {
     case SIGINT:
@@ -612,7 +1354,15 @@ void term_handler(int signum)
         break;
     default:
         if( childpid>0 ) {
-            kill( childpid, signum );
+            // The child is a session leader. Signal its entire process group, so helpers it spawned go down with it
+            if( kill( -childpid, signum )!=0 )
+                kill( childpid, signum );
+
+            // runprogram() escalates to SIGKILL if the group is still around once the grace period is over
+            if( kill_deadline.tv_sec==0 ) {
+                clock_gettime( CLOCK_MONOTONIC, &kill_deadline );
+                kill_deadline.tv_sec+=KILL_GRACE_SECONDS;
+            }
         }
     }
 